@@ -1,6 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <limits.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 /* ******************************************************************
  ALTERNATING BIT AND GO-BACK-N NETWORK EMULATOR: VERSION 1.1  J.F.Kurose
@@ -19,24 +28,63 @@
 #define BIDIRECTIONAL 0    /* change to 1 if you're doing extra credit */
 /* and write a routine called B_output */
 
+/* a "pbuf" holds payload bytes that are shared by reference instead of  */
+/* copied from layer to layer.  The data is written once where it is      */
+/* created.  Every msg or pkt kept anywhere (a send buffer, the channel,  */
+/* a receive buffer) holds one reference, and the last one frees it.      */
+struct pbuf {
+	int refcnt;
+	int size;
+	char *data;
+};
+
 /* a "msg" is the data unit passed from layer 5 (teachers code) to layer  */
 /* 4 (students' code).  It contains the data (characters) to be delivered */
-/* to layer 5 via the students transport level protocol entities.         */
+/* to layer 5 via the students transport level protocol entities.  A msg  */
+/* can be of any length.  Its data lives in buf, which layer 4 has to     */
+/* take a reference on to keep any of it past its return.                 */
 struct msg {
-	char data[20];
+	int length;
+	char *data;
+	struct pbuf *buf;
 };
 
+/* largest payload a packet can carry, the upper limit for the MSS */
+#define MAX_MSS 1460
+
 /* a packet is the data unit passed from layer 4 (students code) to layer */
 /* 3 (teachers code).  Note the pre-defined packet structure, which all   */
-/* students must follow. */
+/* students must follow.  A msg longer than the MSS is split into several */
+/* packets (segments); eom is set on the one that ends the msg.  A packet */
+/* can instead carry several whole msgs, each preceded by its length as   */
+/* an int; eom is EOM_BATCH then.  The payload points into buf, usually   */
+/* straight into the buf of the msg.                                      */
 struct pkt {
 	int seqnum;
 	int acknum;
 	int checksum;
-	char payload[20];
+	int length;             /* payload bytes in use */
+	int eom;                /* 1 on the last segment of a msg, or EOM_BATCH */
+	char *payload;
+	struct pbuf *buf;
+};
+
+#define EOM_BATCH 2
+
+/* bytes a packet puts on the wire besides its payload */
+#define PKT_HEADER (5 * sizeof (int))
+
+/* an ACK is passed from layer 4 to layer 3 in this compact form.  It   */
+/* carries only the header fields, the receiver's advertised window and */
+/* the checksum, without a payload.                                     */
+struct ackpkt {
+	int seqnum;
+	int acknum;
+	int window;             /* bytes the receiver can still take */
+	int checksum;
 };
 
-/********* STUDENTS WRITE THE NEXT SEVEN ROUTINES *********/
+/********* STUDENTS WRITE THE NEXT TEN ROUTINES *********/
 
 /********* Global variables for Alternating Bit ***********/
 int expectedacknum_sender; /* ACK number expected by the sender */
@@ -47,55 +95,465 @@ typedef enum {
 
 waitstatus ackwait_sender; /* A boolean check for sender waiting for an ACK */
 struct pkt sndpkt_sender; /* Packet the sender resends if it times out */
-struct pkt sndpkt_receiver; /* ACK packet the receiver resends for a duplicate packet */
+struct ackpkt sndpkt_receiver; /* ACK the receiver resends for a duplicate packet */
 
 int expectedseqnum_receiver; /* Sequence number expected by the receiver */
 int oncethru; /* Check if receiver has received at least one proper packet */
 float time_interval = 30;
+int mss = 20; /* Largest payload put in one packet, up to MAX_MSS */
+
+/* Nagle-style coalescing. A message that fits in a packet along with
+ * its length word waits in a batch for up to coalesce_delay, and
+ * further messages join it until it is full. The batch is then sent
+ * as one packet.
+ */
+#define COALESCE_TIMER 1 /* A's extra timer that sends a waiting batch */
+int coalesce = 0; /* 1: batch small layer 5 messages into one packet */
+float coalesce_delay = 5; /* Longest time a message waits in a batch */
+struct pbuf *batch_buf = NULL; /* The batch being filled, mss bytes */
+int batch_len = 0; /* Bytes in it, length words included */
+int batch_count = 0; /* Messages in it */
+float batch_start; /* Time its first message arrived */
+float batch_spread; /* Sum of how much later the others arrived */
+
+/* Flow control. B's application reads the messages handed to it out
+ * of a buffer of rcv_buff_bytes, at app_read_rate bytes per time unit.
+ * Every ACK advertises the room left in that buffer and A keeps the
+ * bytes it has in flight within the last window advertised. With the
+ * window closed and nothing in flight, A probes it on PERSIST_TIMER.
+ */
+#define READ_TIMER 1 /* B's extra timer, goes off when a message is read */
+#define PERSIST_TIMER 3 /* A's extra timer that probes a closed window */
+float app_read_rate = 0; /* Bytes B's application reads per time unit, 0: at once */
+int rcv_buff_bytes = 65536; /* Size of B's read buffer */
+struct rdmsg {
+	struct msg msg;
+	struct rdmsg *next;
+};
+struct rdmsg *read_head = NULL, *read_tail = NULL; /* Messages not yet read */
+int unread_bytes = 0; /* Bytes in those */
+int peer_window; /* Window B last advertised */
+int persist_armed = 0; /* 1 while PERSIST_TIMER runs */
+
+/* The message being reassembled at B from its segments. While they
+ * are slices of one pbuf that follow each other, the message is just
+ * a longer slice. Otherwise B copies it into a pbuf of its own.
+ */
+struct pbuf *rasm_buf = NULL; /* Buffer the message is in */
+char *rasm_data; /* Where the message starts in it */
+int rasm_len = 0; /* Bytes of the message received so far */
+int rasm_own = 0; /* 1 if rasm_buf is B's own copy */
+
+/* FIFO of segments of layer 5 messages waiting for the outstanding packet to be ACKed */
+int queue_size = 64; /* Initial size of the queue, doubled as it fills */
+int queue_max_bytes = 1 << 20; /* Memory cap the queue may grow up to */
+int defer_when_full = 1; /* 1: defer layer5 arrivals at the cap, 0: drop them */
+int queue_head, queue_count; /* Oldest queued segment and number queued */
+struct pkt *send_queue; /* Circular queue of segments not yet sent */
+float *queue_time; /* Time each queued segment arrived from layer 5 */
 
 /* Counters for displaying the simulation results */
 int number_1 = 0; /* Packets sent from A application layer */
 int number_2 = 0; /* Packets sent from A transport layer */
 int number_3 = 0; /* Packets received at B transport layer */
 int number_4 = 0; /* Packets received at B application layer */
+int number_batches = 0; /* Packets that carried more than one message */
+int number_coalesced = 0; /* Messages carried in those */
+int number_waited = 0; /* Messages that went through a batch */
+float coalesce_wait = 0; /* Total time messages waited in a batch */
+int number_window_stalls = 0; /* Times A held packets back for B's window */
+int number_probes = 0; /* Packets A sent to probe a closed window */
+int number_no_room = 0; /* Packets B dropped for lack of buffer space */
+int max_unread = 0; /* Most bytes waiting to be read at B */
+int number_dropped = 0; /* Messages dropped because the queue hit its cap */
+int number_queued = 0; /* Segments that left the queue for their first send */
+int max_queue_depth = 0; /* Largest number of segments queued at once */
+float queue_delay = 0; /* Total time segments waited before their first send */
+float queue_area = 0; /* Queue depth integrated over time */
+float queue_changed = 0; /* Time the queue depth last changed */
 /**********************************************************/
 starttimer(int,float);
 stoptimer(int);
+startauxtimer(int,int,float);
+stopauxtimer(int,int);
 tolayer3(int, struct pkt);
-tolayer5(int, char*);
+tolayer3_ack(int, struct ackpkt);
+tolayer5(int, char*, int);
 init();
 generate_next_arrival();
+float get_sim_time();
+
+/* Payload copies that are still made, counted by where they happen */
+#define COPY_A     0   /* layer 4 of A */
+#define COPY_L3    1   /* the channel */
+#define COPY_B     2   /* layer 4 of B */
+int  ncopies[3];       /* number of payload copies */
+long ncopybytes[3];    /* bytes in those copies */
+
+/* Byte ranges holding data the medium corrupted without the checksum
+ * noticing. The emulator follows them through copies so it can tell
+ * when such data reaches layer 5.
+ */
+struct badrange {
+	char *lo, *hi;
+};
+struct badrange *badranges = NULL;
+int nbadranges = 0, maxbadranges = 0;
 
-/* called from layer 5, passed the data to be sent to other side */
-A_output(message)
-struct msg message;
+/* Note len bytes from p on as corrupted */
+bad_mark(p, len)
+char *p;
+int len;
+{
+	if (nbadranges == maxbadranges) {
+		maxbadranges = maxbadranges ? 2 * maxbadranges : 16;
+		badranges = (struct badrange *) realloc (badranges,
+				maxbadranges * sizeof (struct badrange));
+	}
+	badranges[nbadranges].lo = p;
+	badranges[nbadranges].hi = p + len;
+	nbadranges++;
+}
+
+/* 1 if any of len bytes from p on are corrupted */
+int bad_overlaps(p, len)
+char *p;
+int len;
 {
 	int i;
 
-	/* Increment counter for number of packets
-	 * generated at the application layer.
-	 */
-	number_1++;
-	message.data[20] = 0;
-	printf("[Sender] Application data \"%s\" generated.\n", message.data);
+	for (i = 0; i < nbadranges; i++) {
+		if (p < badranges[i].hi && p + len > badranges[i].lo) {
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	/* If we are waiting for an ACK, then discard packet */
-	if (ackwait_sender == true) {
-		printf("[Sender] The above application data discarded since"
-				" waiting for ACK\n");
-		return;
+/* Forget the corrupted ranges inside a pbuf that is being freed */
+bad_forget(b)
+struct pbuf *b;
+{
+	int i;
+
+	for (i = 0; i < nbadranges; ) {
+		if (badranges[i].lo >= b->data && badranges[i].hi <= b->data + b->size) {
+			badranges[i] = badranges[--nbadranges];
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+/* Allocate a pbuf of size bytes holding one reference */
+struct pbuf *pbuf_alloc(size)
+int size;
+{
+	struct pbuf *b;
+
+	b = (struct pbuf *) malloc (sizeof (struct pbuf) + size);
+	b->refcnt = 1;
+	b->size = size;
+	b->data = (char *) (b + 1);
+	return b;
+}
+
+/* Take another reference on a pbuf */
+struct pbuf *pbuf_ref(b)
+struct pbuf *b;
+{
+	if (b != NULL) {
+		b->refcnt++;
+	}
+	return b;
+}
+
+/* Drop a reference, freeing the pbuf with the last one */
+pbuf_unref(b)
+struct pbuf *b;
+{
+	if (b != NULL && --b->refcnt == 0) {
+		if (nbadranges > 0) {
+			bad_forget(b);
+		}
+		free(b);
 	}
+}
 
+/* Copy payload bytes, counting the copy against layer */
+pbuf_copy(dst, src, len, layer)
+char *dst, *src;
+int len, layer;
+{
+	memcpy(dst, src, len);
+	ncopies[layer]++;
+	ncopybytes[layer] += len;
+	if (nbadranges > 0 && bad_overlaps(src, len)) {
+		bad_mark(dst, len);
+	}
+}
+
+/* Checksum algorithms. checksum_alg picks the one that every packet
+ * is built and verified with in this run:
+ *  - CHECKSUM_ADDITIVE: the header fields + the payload bytes (the original)
+ *  - CHECKSUM_INTERNET: 16-bit one's complement sum (RFC 1071)
+ *  - CHECKSUM_CRC32C:   CRC32C, using the SSE4.2 or ARMv8 CRC
+ *                       instructions when the compiler targets them
+ * All of them cover the header fields and the payload in use, but not
+ * the checksum field itself.
+ */
+#define CHECKSUM_ADDITIVE 0
+#define CHECKSUM_INTERNET 1
+#define CHECKSUM_CRC32C   2
+int checksum_alg = CHECKSUM_CRC32C;
+char *checksum_name[] = {"additive", "Internet", "CRC32C"};
+
+#if !defined(__SSE4_2__) && !defined(__ARM_FEATURE_CRC32)
+/* Table for the bytewise CRC32C fallback, filled on first use */
+unsigned int crc32c_table[256];
+int crc32c_ready = 0;
+#endif
+
+/* CRC32C (Castagnoli polynomial) of a buffer, continuing from the
+ * CRC crc of the bytes before it (0 to start)
+ */
+unsigned int crc32c(crc, bytes, len)
+unsigned int crc;
+unsigned char *bytes;
+int len;
+{
+	int i;
+#if defined(__SSE4_2__) || defined(__ARM_FEATURE_CRC32)
+	unsigned int word;
+
+	crc = ~crc;
+	for (i = 0; i + 4 <= len; i += 4) {
+		memcpy(&word, bytes + i, 4);
+#if defined(__SSE4_2__)
+		crc = _mm_crc32_u32(crc, word);
+#else
+		crc = __crc32cw(crc, word);
+#endif
+	}
+	for (; i < len; i++) {
+#if defined(__SSE4_2__)
+		crc = _mm_crc32_u8(crc, bytes[i]);
+#else
+		crc = __crc32cb(crc, bytes[i]);
+#endif
+	}
+#else
+	int j;
+	unsigned int c;
+
+	if (!crc32c_ready) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (j = 0; j < 8; j++) {
+				c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+			}
+			crc32c_table[i] = c;
+		}
+		crc32c_ready = 1;
+	}
+	crc = ~crc;
+	for (i = 0; i < len; i++) {
+		crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	}
+#endif
+	return ~crc;
+}
+
+/* Add a buffer to an unfolded RFC 1071 sum. An odd last byte is
+ * padded with zero, so only the last buffer may have an odd length.
+ */
+unsigned int inet_sum(sum, bytes, len)
+unsigned int sum;
+unsigned char *bytes;
+int len;
+{
+	int i;
+
+	for (i = 0; i + 1 < len; i += 2) {
+		sum += (bytes[i] << 8) | bytes[i + 1];
+	}
+	if (i < len) {
+		sum += bytes[i] << 8;
+	}
+	return sum;
+}
+
+/* Checksum of nfields header fields and len payload bytes
+ * with the algorithm selected by checksum_alg
+ */
+int checksum_fields(fields, nfields, payload, len)
+int *fields;
+int nfields;
+char *payload;
+int len;
+{
+	unsigned int sum;
+	int i;
+
+	if (checksum_alg == CHECKSUM_ADDITIVE) {
+		sum = 0;
+		for (i = 0; i < nfields; i++) {
+			sum += fields[i];
+		}
+		for (i = 0; i < len; i++) {
+			sum += payload[i];
+		}
+		return (int) sum;
+	}
+
+	if (checksum_alg == CHECKSUM_INTERNET) {
+		sum = inet_sum(0, (unsigned char *) fields, nfields * 4);
+		sum = inet_sum(sum, (unsigned char *) payload, len);
+		while (sum >> 16) {
+			sum = (sum & 0xffff) + (sum >> 16);
+		}
+		return (int) (~sum & 0xffff);
+	}
+
+	sum = crc32c(0, (unsigned char *) fields, nfields * 4);
+	return (int) crc32c(sum, (unsigned char *) payload, len);
+}
+
+/* Checksum of a packet. A length outside the payload is still
+ * covered as a header field, but no payload is read for it.
+ */
+int compute_checksum(packet)
+struct pkt *packet;
+{
+	int fields[4];
+	int len;
+
+	fields[0] = packet->seqnum;
+	fields[1] = packet->acknum;
+	fields[2] = packet->length;
+	fields[3] = packet->eom;
+	len = (packet->length >= 0 && packet->length <= MAX_MSS) ? packet->length : 0;
+	return checksum_fields(fields, 4, packet->payload, len);
+}
+
+/* Checksum of a compact ACK */
+int compute_ack_checksum(ack)
+struct ackpkt *ack;
+{
+	int fields[3];
+
+	fields[0] = ack->seqnum;
+	fields[1] = ack->acknum;
+	fields[2] = ack->window;
+	return checksum_fields(fields, 3, NULL, 0);
+}
+
+/* Account the time spent at the current queue depth before changing it */
+update_queue_area()
+{
+	queue_area += queue_count * (get_sim_time() - queue_changed);
+	queue_changed = get_sim_time();
+}
+
+/* Grow the send queue geometrically up to queue_max_bytes. The ring
+ * is unrolled into the new array so that queue_head lands on slot 0.
+ * Returns 0 if the queue is already at its cap.
+ */
+int grow_queue()
+{
+	int i, newsize;
+	struct pkt *newqueue;
+	float *newtime;
+
+	newsize = queue_size * 2;
+	if ((int) (newsize * (sizeof (struct pkt) + sizeof (float))) > queue_max_bytes) {
+		newsize = queue_max_bytes / (sizeof (struct pkt) + sizeof (float));
+	}
+	if (newsize <= queue_size) {
+		return 0;
+	}
+
+	newqueue = (struct pkt *) malloc (sizeof (struct pkt) * newsize);
+	newtime = (float *) malloc (sizeof (float) * newsize);
+
+	for (i = 0; i < queue_count; i++) {
+		newqueue[i] = send_queue[(queue_head + i) % queue_size];
+		newtime[i] = queue_time[(queue_head + i) % queue_size];
+	}
+
+	free(send_queue);
+	free(queue_time);
+	send_queue = newqueue;
+	queue_time = newtime;
+	queue_size = newsize;
+	queue_head = 0;
+	return 1;
+}
+
+/* Add a message that fits in a packet to the batch, starting a new
+ * batch and its timer if none is being filled
+ */
+batch_add(message)
+struct msg message;
+{
+	if (batch_count == 0) {
+		batch_buf = pbuf_alloc(mss);
+		batch_len = 0;
+		batch_start = get_sim_time();
+		batch_spread = 0;
+		startauxtimer(0, COALESCE_TIMER, coalesce_delay);
+	}
+	memcpy(batch_buf->data + batch_len, &message.length, sizeof (int));
+	pbuf_copy(batch_buf->data + batch_len + sizeof (int), message.data,
+			message.length, COPY_A);
+	batch_len += sizeof (int) + message.length;
+	batch_count++;
+	batch_spread += get_sim_time() - batch_start;
+}
+
+/* Make the batch the payload of a packet. The batch's reference on
+ * its pbuf moves to the packet. A batch of one message goes out as a
+ * plain packet, without its length word.
+ */
+batch_take(packet)
+struct pkt *packet;
+{
+	packet->buf = batch_buf;
+	if (batch_count == 1) {
+		packet->payload = batch_buf->data + sizeof (int);
+		packet->length = batch_len - sizeof (int);
+		packet->eom = 1;
+	}
+	else {
+		packet->payload = batch_buf->data;
+		packet->length = batch_len;
+		packet->eom = EOM_BATCH;
+		number_batches++;
+		number_coalesced += batch_count;
+	}
+	number_waited += batch_count;
+	coalesce_wait += batch_count * (get_sim_time() - batch_start) - batch_spread;
+	batch_buf = NULL;
+	batch_count = 0;
+	batch_len = 0;
+}
+
+/* Number a segment, send it and wait for its ACK */
+send_segment(segment)
+struct pkt *segment;
+{
 	/* Fill up the packet with header and data */
 	sndpkt_sender.seqnum = sndpkt_sender.seqnum == 0 ? 1 : 0;
 	sndpkt_sender.acknum = sndpkt_sender.seqnum;
-	strncpy(sndpkt_sender.payload, message.data, 20);
-	sndpkt_sender.checksum = sndpkt_sender.seqnum + sndpkt_sender.acknum;
+	sndpkt_sender.length = segment->length;
+	sndpkt_sender.eom = segment->eom;
 
-	/* Add up the payload data byte by byte into the checksum */
-	for (i = 0; i < 20; i++) {
-		sndpkt_sender.checksum += message.data[i];
-	}
+	/* The queue's reference on the payload moves over with it */
+	pbuf_unref(sndpkt_sender.buf);
+	sndpkt_sender.buf = segment->buf;
+	sndpkt_sender.payload = segment->payload;
+	sndpkt_sender.checksum = compute_checksum(&sndpkt_sender);
 
 	/* Hand the packet to the network layer */
 	tolayer3(0, sndpkt_sender);
@@ -111,46 +569,198 @@ struct msg message;
 
 	ackwait_sender = true;
 	expectedacknum_sender = sndpkt_sender.seqnum;
+}
 
-	return;
+/* Append a segment to the send queue and return it to be filled in */
+struct pkt *queue_append()
+{
+	int i;
+
+	update_queue_area();
+	i = (queue_head + queue_count) % queue_size;
+	queue_time[i] = get_sim_time();
+	queue_count++;
+	if (queue_count > max_queue_depth) {
+		max_queue_depth = queue_count;
+	}
+	return &send_queue[i];
+}
+
+/* Take the oldest segment off the queue and send it */
+send_next()
+{
+	int i;
+
+	update_queue_area();
+	queue_delay += get_sim_time() - queue_time[queue_head];
+	number_queued++;
+	i = queue_head;
+	queue_head = (queue_head + 1) % queue_size;
+	queue_count--;
+	send_segment(&send_queue[i]);
+}
+
+/* Send the oldest queued segment, if any, once the ACK for the last
+ * one is in and B has room for it. With the window closed, probe it
+ * when PERSIST_TIMER goes off.
+ */
+try_send()
+{
+	if (ackwait_sender == true || queue_count == 0) {
+		return;
+	}
+	if (send_queue[queue_head].length > peer_window) {
+		number_window_stalls++;
+		if (!persist_armed) {
+			startauxtimer(0, PERSIST_TIMER, time_interval);
+			persist_armed = 1;
+		}
+		return;
+	}
+	send_next();
+}
+
+/* called from layer 5, passed the data to be sent to other side.
+ * Returns 0 if the message is refused and layer 5 should defer it.
+ */
+A_output(message)
+struct msg message;
+{
+	int i, nseg, offset, batchable, needed;
+	struct pkt *segment;
+
+	/* The message is split into segments of at most mss bytes.
+	 * An empty message still takes one segment to mark its end.
+	 */
+	nseg = message.length > 0 ? (message.length + mss - 1) / mss : 1;
+
+	/* A message that fits in a packet with its length word may be
+	 * coalesced. Room is always kept for the packet of a pending
+	 * batch, which is sent first if this message cannot join it.
+	 */
+	batchable = coalesce && (int) sizeof (int) + message.length <= mss;
+	if (!batchable) {
+		needed = nseg + (batch_count > 0);
+	}
+	else if (batch_count > 0 && batch_len + (int) sizeof (int) + message.length > mss) {
+		needed = 2;
+	}
+	else {
+		needed = 1;
+	}
+
+	/* Queue all the segments. At the memory cap apply backpressure
+	 * on layer 5, unless the queue is empty and the message would
+	 * never fit.
+	 */
+	while (queue_size - queue_count < needed && grow_queue()) {
+	}
+	if (queue_size - queue_count < needed) {
+		if (defer_when_full && queue_count > 0) {
+			return 0;
+		}
+		number_1++;
+		number_dropped++;
+		printf("[Sender] Send queue full. Application data dropped.\n");
+		return 1;
+	}
+
+	/* Increment counter for number of packets
+	 * generated at the application layer.
+	 */
+	number_1++;
+	printf("[Sender] Application data \"%.*s\" (%d bytes) generated.\n",
+			message.length < 20 ? message.length : 20, message.data,
+			message.length);
+
+	if (ackwait_sender == true) {
+		printf("[Sender] The above application data queued since"
+				" waiting for ACK\n");
+	}
+
+	/* Queue a pending batch the message cannot join, so that
+	 * the messages stay in order
+	 */
+	if (batch_count > 0 && (!batchable ||
+			batch_len + (int) sizeof (int) + message.length > mss)) {
+		stopauxtimer(0, COALESCE_TIMER);
+		batch_take(queue_append());
+	}
+
+	if (batchable) {
+		/* Queue the batch once no other message fits in it */
+		batch_add(message);
+		if (batch_len + (int) sizeof (int) > mss) {
+			stopauxtimer(0, COALESCE_TIMER);
+			batch_take(queue_append());
+		}
+	}
+	else {
+		/* Each segment is a slice of the message's pbuf, not a copy */
+		for (i = 0, offset = 0; i < nseg; i++, offset += mss) {
+			segment = queue_append();
+			segment->length = message.length - offset < mss ?
+					message.length - offset : mss;
+			segment->eom = (i == nseg - 1);
+			segment->buf = pbuf_ref(message.buf);
+			segment->payload = message.data + offset;
+		}
+	}
+
+	/* Send the first segment right away unless we wait for an ACK */
+	try_send();
+	return 1;
 }
 
 B_output(message)  /* need be completed only for extra credit */
 struct msg message;
 {
 	/* Nothing to do here for alternating bit protocol*/
-	return;
+	return 1;
 }
 
 /* called from layer 3, when a packet arrives for layer 4 */
 A_input(packet)
 struct pkt packet;
 {
-	int checksum, i;
+	/* B only ever sends compact ACKs, which arrive at A_ackinput */
+	return;
+}
+
+/* called from layer 3, when a compact ACK arrives for layer 4 */
+A_ackinput(ack)
+struct ackpkt ack;
+{
+	int checksum;
 
 	/* Check if the ACK is indeed the one we are waiting for */
-	if (packet.acknum != expectedacknum_sender) {
+	if (ack.acknum != expectedacknum_sender) {
 		printf("[Sender] Corrupt ACK received.\n");
 		return;
 	}
 
-	/* Build the packet checksum to verify packet corruption */
-	checksum = packet.seqnum + packet.acknum;
-
-	for (i = 0; i < 20; i++) {
-		checksum += packet.payload[i];
-	}
+	/* Build the ACK checksum to verify corruption */
+	checksum = compute_ack_checksum(&ack);
 
 	/* Compare the header checksum and the computed checksum */
-	if (checksum != packet.checksum) {
+	if (checksum != ack.checksum) {
 		return;
 	}
 
-	/* All tests passed and packet is not corrupted */
-	printf("[Sender] ACK %d received.\n", packet.acknum);
+	/* All tests passed and the ACK is not corrupted */
+	peer_window = ack.window;
+	if (ackwait_sender == false) {
+		/* A window update, or a duplicate of the last ACK */
+		try_send();
+		return;
+	}
+	printf("[Sender] ACK %d received.\n", ack.acknum);
 	stoptimer(0);
 	ackwait_sender = false;
 
+	/* Send the oldest queued segment, if any, right away */
+	try_send();
+
 	return;
 }
 
@@ -168,6 +778,35 @@ A_timerinterrupt()
 	return;
 }
 
+/* called when one of A's extra timers goes off */
+A_auxtimerinterrupt(timerid)
+int timerid;
+{
+	/* A batch has waited long enough, queue it as it is */
+	if (timerid == COALESCE_TIMER && batch_count > 0) {
+		printf("[Sender] Coalescing delay over. Sending %d messages.\n",
+				batch_count);
+		batch_take(queue_append());
+		try_send();
+	}
+
+	/* The window has stayed closed: send the segment anyway. If B
+	 * has no room it drops it, and it is re-sent on timeouts until
+	 * the window opens.
+	 */
+	if (timerid == PERSIST_TIMER) {
+		persist_armed = 0;
+		if (ackwait_sender == false && queue_count > 0) {
+			if (send_queue[queue_head].length > peer_window) {
+				printf("[Sender] Window closed. Probing it.\n");
+				number_probes++;
+			}
+			send_next();
+		}
+	}
+	return;
+}
+
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
 A_init()
@@ -176,20 +815,167 @@ A_init()
 	 * will be set to zero on the first check
 	 */
 	sndpkt_sender.seqnum = 1;
+	sndpkt_sender.buf = NULL;
 
 	/* Not waiting for any packet. Hence false */
 	ackwait_sender = false;
+
+	/* B starts out with an empty read buffer */
+	peer_window = rcv_buff_bytes;
+
+	if (mss < 1 || mss > MAX_MSS) {
+		printf("MSS %d is outside 1 to %d bytes.\n", mss, MAX_MSS);
+		exit(0);
+	}
+
+	send_queue = (struct pkt *) malloc (sizeof (struct pkt) * queue_size);
+	queue_time = (float *) malloc (sizeof (float) * queue_size);
+	queue_head = 0;
+	queue_count = 0;
 	return;
 }
 
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
 
+/* Room left in B's read buffer, the window B advertises */
+int rcv_window()
+{
+	int window;
+
+	window = rcv_buff_bytes - unread_bytes;
+	return window > 0 ? window : 0;
+}
+
+/* Hand a message to B's application. Unless it reads at once, the
+ * message waits in the read buffer, holding a reference on its pbuf.
+ */
+app_deliver(data, length, buf)
+char *data;
+int length;
+struct pbuf *buf;
+{
+	struct rdmsg *r;
+
+	if (app_read_rate <= 0) {
+		tolayer5(1, data, length);
+		return;
+	}
+	r = (struct rdmsg *) malloc (sizeof (struct rdmsg));
+	r->msg.data = data;
+	r->msg.length = length;
+	r->msg.buf = pbuf_ref(buf);
+	r->next = NULL;
+	if (read_head == NULL) {
+		read_head = r;
+		startauxtimer(1, READ_TIMER, length / app_read_rate);
+	}
+	else {
+		read_tail->next = r;
+	}
+	read_tail = r;
+	unread_bytes += length;
+	if (unread_bytes > max_unread) {
+		max_unread = unread_bytes;
+	}
+}
+
+/* B's application has read the oldest message in the read buffer.
+ * Returns 1 if that opened a window that was too small for a packet.
+ */
+int app_read()
+{
+	struct rdmsg *r;
+	int closed;
+
+	closed = rcv_window() < mss;
+	r = read_head;
+	tolayer5(1, r->msg.data, r->msg.length);
+	unread_bytes -= r->msg.length;
+	pbuf_unref(r->msg.buf);
+	read_head = r->next;
+	free(r);
+	if (read_head != NULL) {
+		startauxtimer(1, READ_TIMER, read_head->msg.length / app_read_rate);
+	}
+	return closed && rcv_window() >= mss;
+}
+
+/* Append an in-order segment to the message being reassembled and
+ * hand the message to layer 5 once its last segment is in. A batch
+ * of whole messages is split up instead.
+ */
+deliver_segment(packet)
+struct pkt *packet;
+{
+	struct pbuf *b;
+	int offset, len;
+
+	/* A batch holds whole messages: hand each to layer 5 in place */
+	if (packet->eom == EOM_BATCH) {
+		number_4++;
+		for (offset = 0; offset + (int) sizeof (int) <= packet->length;
+				offset += sizeof (int) + len) {
+			memcpy(&len, packet->payload + offset, sizeof (int));
+			if (len < 0 || len > packet->length - offset - (int) sizeof (int)) {
+				break;
+			}
+			app_deliver(packet->payload + offset + sizeof (int), len, packet->buf);
+			printf("[Receiver] Data \"%.*s\" (%d bytes) from a batch handed over to application layer.\n",
+					len < 20 ? len : 20, packet->payload + offset + sizeof (int), len);
+		}
+		return;
+	}
+
+	if (rasm_len == 0) {
+		pbuf_unref(rasm_buf);
+		rasm_buf = pbuf_ref(packet->buf);
+		rasm_data = packet->payload;
+		rasm_own = 0;
+	}
+	else if (rasm_own || packet->buf != rasm_buf
+			|| packet->payload != rasm_data + rasm_len) {
+		/* Not the next slice of the same pbuf: copy it out */
+		if (!rasm_own || rasm_len + packet->length > rasm_buf->size) {
+			b = pbuf_alloc(2 * (rasm_len + packet->length));
+			pbuf_copy(b->data, rasm_data, rasm_len, COPY_B);
+			pbuf_unref(rasm_buf);
+			rasm_buf = b;
+			rasm_data = b->data;
+			rasm_own = 1;
+		}
+		pbuf_copy(rasm_data + rasm_len, packet->payload, packet->length, COPY_B);
+	}
+	rasm_len += packet->length;
+
+	/* Increment counter for number of packets
+	 * delivered to the application layer.
+	 */
+	number_4++;
+
+	if (packet->eom) {
+		app_deliver(rasm_data, rasm_len, rasm_buf);
+		printf("[Receiver] Data \"%.*s\" (%d bytes) handed over to application layer.\n",
+				rasm_len < 20 ? rasm_len : 20, rasm_data, rasm_len);
+		pbuf_unref(rasm_buf);
+		rasm_buf = NULL;
+		rasm_len = 0;
+	}
+}
+
+/* Send B's last ACK, advertising the window B has now */
+send_ack()
+{
+	sndpkt_receiver.window = rcv_window();
+	sndpkt_receiver.checksum = compute_ack_checksum(&sndpkt_receiver);
+	tolayer3_ack(1, sndpkt_receiver);
+}
+
 /* called from layer 3, when a packet arrives for layer 4 at B*/
 B_input(packet)
 struct pkt packet;
 {
-	int checksum, i;
+	int checksum;
 
 	/* Increment counter for number of packets
 	 * received at the transport layer.
@@ -203,17 +989,13 @@ struct pkt packet;
 		/* Once thru check means we have a previously sent ACK. Re-send it */
 		if (oncethru == 1) {
 			printf("[Receiver] Re-sending ACK %d.\n", sndpkt_receiver.acknum);
-			tolayer3(1, sndpkt_receiver);
+			send_ack();
 		}
 		return;
 	}
 
 	/* Build the packet checksum to verify packet corruption */
-	checksum = packet.seqnum + packet.acknum;
-
-	for (i = 0; i < 20; i++) {
-		checksum += packet.payload[i];
-	}
+	checksum = compute_checksum(&packet);
 
 	/* Compare the header checksum and the computed checksum */
 	if (checksum != packet.checksum) {
@@ -222,41 +1004,37 @@ struct pkt packet;
 		/* Once thru check means we have a previously sent ACK. Re-send it */
 		if (oncethru == 1) {
 			printf("[Receiver] Re-sending ACK %d.\n", sndpkt_receiver.acknum);
-			tolayer3(1, sndpkt_receiver);
+			send_ack();
+		}
+		return;
+	}
+
+	/* Drop the packet if the read buffer has no room for it */
+	if (packet.length > rcv_window()) {
+		printf("[Receiver] No room for packet %d. Dropped.\n", packet.seqnum);
+		number_no_room++;
+		if (oncethru == 1) {
+			printf("[Receiver] Re-sending ACK %d.\n", sndpkt_receiver.acknum);
+			send_ack();
 		}
 		return;
 	}
 
 	/* All tests passed and packet is not corrupted.
-	 * Hand the packet to the application layer.
+	 * Hand the segment on towards the application layer.
 	 */
 	printf("[Receiver] Packet %d received.\n", packet.seqnum);
-	packet.payload[20] = 0;
-	tolayer5(1, packet.payload);
-	printf("[Receiver] Data \"%s\" handed over to application layer.\n",
-			packet.payload);
+	deliver_segment(&packet);
 
-	/* Increment counter for number of packets
-	 * delivered to the application layer.
-	 */
-	number_4++;
-
-	/* Prepare the ACK packet to ACK the sender.
-	 * Fill up the packet with header and data.
+	/* Prepare the ACK to ACK the sender.
+	 * An ACK is header only, there is no data to copy.
 	 */
 	sndpkt_receiver.acknum = packet.seqnum;
 	sndpkt_receiver.seqnum = sndpkt_receiver.acknum;
-	strncpy(sndpkt_receiver.payload, packet.payload, 20);
-	sndpkt_receiver.checksum = sndpkt_receiver.seqnum + sndpkt_receiver.acknum;
-
-	/* Add up the payload data byte by byte into the checksum */
-	for (i = 0; i < 20; i++) {
-		sndpkt_receiver.checksum += packet.payload[i];
-	}
 
 	/* Hand the packet to the network layer */
 	printf("[Receiver] ACK %d sent.\n", sndpkt_receiver.acknum);
-	tolayer3(1, sndpkt_receiver);
+	send_ack();
 
 	/* Set once thru since we now have a proper packet to resend */
 	oncethru = 1;
@@ -274,6 +1052,21 @@ B_timerinterrupt()
 	return;
 }
 
+/* called when one of B's extra timers goes off */
+B_auxtimerinterrupt(timerid)
+int timerid;
+{
+	/* The application has read a message. Tell A once the window
+	 * has room for a packet again.
+	 */
+	if (timerid == READ_TIMER && app_read() && oncethru == 1) {
+		printf("[Receiver] Window update, ACK %d re-sent.\n",
+				sndpkt_receiver.acknum);
+		send_ack();
+	}
+	return;
+}
+
 /* the following rouytine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
 B_init()
@@ -281,6 +1074,12 @@ B_init()
 	/* The first packet received should have the sequence number 0 */
 	expectedseqnum_receiver = 0;
 	oncethru = 0;
+
+	if (rcv_buff_bytes < mss) {
+		printf("Read buffer of %d bytes cannot take a %d byte packet.\n",
+				rcv_buff_bytes, mss);
+		exit(0);
+	}
 	return;
 }
 
@@ -306,6 +1105,12 @@ struct event {
 	int evtype;             /* event type code */
 	int eventity;           /* entity where event occurs */
 	struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
+	struct ackpkt *ackptr;  /* ptr to compact ACK (if any) instead */
+	int corrupt;            /* packet (if any) was corrupted by the media, */
+	                        /*   2 if it has a payload buffer of its own */
+	int timerid;            /* which timer of the entity (0 is the classic one) */
+	int order;              /* a packet's place among those sent its way */
+	int msglen;             /* length of a layer 5 msg, -1 to draw one */
 	struct event *prev;
 	struct event *next;
 };
@@ -329,19 +1134,219 @@ int nsimmax = 0;           /* number of msgs to generate, then stop */
 float time = 0.000;
 float lossprob;            /* probability that a packet is dropped  */
 float corruptprob;         /* probability that one bit is packet is flipped */
+float lossprob_dir[2] = {-1, -1};    /* the two for A->B and B->A, */
+float corruptprob_dir[2] = {-1, -1}; /*   negative: the ones entered */
+float delay_min[2] = {1, 1};    /* the medium takes delay_min plus up to */
+float delay_spread[2] = {9, 9}; /*   delay_spread, A->B and B->A */
+int   corrupt_model = 0;   /* 0: corruptprob of packets get a fixed damage */
+                           /* 1: every bit on the wire, header, payload or */
+                           /*    ACK, flips on its own with probability ber */
+double ber[2] = {1e-4, 1e-4}; /* bit error rates for corrupt_model 1 */
+int   nbadmissed;          /* corrupted packets the checksum let through */
+int   nbadmsgs5;           /* msgs handed to layer 5 holding corrupted data */
+int   nunframed;           /* packets lost to a corrupted length field */
 float lambda;              /* arrival rate of messages from layer 5 */
-int   ntolayer3;           /* number sent into layer 3 */
-int   nlost;               /* number lost in media */
-int ncorrupt;              /* number corrupted by media*/
+int   msgsize_min = 20;    /* layer 5 msg lengths are uniform over */
+int   msgsize_max = 20;    /*   [msgsize_min, msgsize_max] bytes */
+int   workload = 0;        /* how layer 5 msgs arrive, lambda apart on average: */
+                           /* 0: uniform on [0, 2*lambda] between them */
+                           /* 1: Poisson */
+                           /* 2: on/off, Poisson during exponential on  */
+                           /*    periods of on_time, silent during off  */
+                           /*    periods of off_time                    */
+                           /* 3: bulk, the next msg is there as soon as */
+                           /*    A takes one (relies on A refusing msgs */
+                           /*    when full, see defer_when_full), and   */
+                           /*    the run goes on until all are through  */
+                           /* 4: replay workload_file, see next_replayed */
+char *workload_name[] = {"uniform", "Poisson", "on/off", "bulk", "replay"};
+float on_time = 100;       /* mean on period of the on/off source */
+float off_time = 400;      /* mean off period of it */
+float on_end;              /* end of its current on period */
+char *workload_file = NULL; /* arrival times to replay */
+FILE *wl_fp;
+float wl_offset;           /* added to the times on each pass over the file */
+float wl_last;             /* last time read from it */
+int   wl_nrec;             /* arrivals read from it */
+int   wl_nwrap;            /* times it ran out and started over */
+float lastgen;             /* time of the latest msg from layer 5 */
+int   run_to_end;          /* 1: after the last msg, run until all are through */
+char *send_file = NULL;    /* A sends this file, in msgs sized as above, */
+char *recv_file = NULL;    /*   and B writes what it gets to this one */
+FILE *send_fp, *recv_fp;
+long  send_bytes, recv_bytes; /* bytes of the file A got and B handed up */
+unsigned long long send_hash, recv_hash; /* FNV-1a of each stream */
+float cpu_start;           /* host CPU seconds used before the run */
+int   loss_model = 0;      /* 0: lose packets independently with lossprob */
+                           /* 1: Gilbert-Elliott, a good and a bad state */
+                           /*    per direction with their own losses    */
+                           /* 2: replay recorded losses, corruption and  */
+                           /*    delays from trace_file, see replay_next */
+float ge_p[2] = {0.01, 0.01};   /* chance per packet of going bad, A->B and B->A */
+float ge_r[2] = {0.3, 0.3};     /* chance per packet of going good again */
+float ge_loss_good[2] = {0.0, 0.0}; /* loss probability in the good state */
+float ge_loss_bad[2] = {1.0, 1.0};  /* loss probability in the bad state */
+int   ge_bad[2];           /* 1 while a direction is in the bad state */
+int   lossrun[2];          /* packets lost in a row so far, per direction */
+int   nbursts[2];          /* runs of consecutive losses, per direction */
+int   burstlost[2];        /* packets lost in those */
+int   maxburst[2];         /* longest of them */
+char *trace_file[2] = {NULL, NULL}; /* traces for A->B and B->A, NULL */
+                           /*   for B->A replays the A->B one too   */
+#define REPLAY_CHUNK (1 << 20)  /* bytes of trace let go of at a time */
+struct replay {            /* one direction's trace, mapped and streamed */
+	char  *name;
+	char  *map;            /* the whole file, mapped read only */
+	size_t size;
+	size_t pos;            /* where the next record starts */
+	size_t released;       /* bytes before this are dropped from memory */
+	int    nrec;           /* records replayed */
+	int    nwrap;          /* times it ran out and started over */
+	float  delay;          /* the current record: one-way delay, */
+	int    lost, corrupt;  /*   and whether it was lost or corrupted */
+} replay[2];
+float reorder_prob = 0;    /* chance a packet is held back and overtaken */
+int   reorder_dist = 0;    /* extra delay of a held back packet, 0: uniform */
+                           /*   on [0, 2*reorder_delay], 1: geometric in  */
+                           /*   steps of 10, mean reorder_delay           */
+float reorder_delay = 20;  /* mean extra delay of a held back packet */
+float lastarrival[2];      /* latest in-order arrival scheduled, per direction */
+int   nsent3[2];           /* packets put in flight, per direction */
+int   maxorder[2];         /* highest order delivered so far */
+int   nheld[2];            /* packets held back */
+int   nlate[2];            /* packets that arrived after a later one */
+int   maxdisplace[2];      /* most later packets that overtook one */
+int   ntolayer3[2];        /* number sent into layer 3, A->B and B->A */
+int   nlost[2];            /* number lost in media */
+int ncorrupt[2];           /* number corrupted by media*/
+int   nduplicate[2];       /* number duplicated by media */
+float dupprob[2] = {0.0, 0.0}; /* chance a packet arrives twice, A->B and B->A */
+int nbadarrive[2];         /* number of corrupted packets delivered */
+int nbadcaught[2];         /* number of those the checksum caught */
+int   nbytes3[2];          /* bytes sent into layer 3 by A and by B */
+int   nmsgs5;              /* number of msgs handed to layer 5 */
+int   nevents;             /* number of events simulated */
+long  nbytes5;             /* bytes in those msgs */
+
+struct deferred {          /* layer5 msg held back while A refuses it */
+	struct msg msg;
+	float arrtime;
+	struct deferred *next;
+};
+struct deferred *deferhead = NULL, *defertail = NULL;
+
+/* Bottleneck link. With its link_rate set, a direction sends its    */
+/* packets through a FIFO of link_queue_bytes in front of a link     */
+/* that takes size / link_rate to put a packet on the wire. A packet */
+/* that does not fit is tail-dropped, and RED or CoDel may drop      */
+/* packets before the queue is full.                                  */
+float link_rate[2] = {0, 0}; /* bytes per time unit A->B and B->A, 0: none */
+int   link_queue_bytes = 4000; /* room in the FIFO, per direction */
+int   aqm = 0;             /* 0: tail drop only, 1: RED, 2: CoDel */
+float red_wq = 0.002;      /* RED: weight of a new sample in the average */
+float red_min = 1000;      /* RED: average queue bytes where drops start */
+float red_max = 3000;      /* RED: average queue bytes where all are dropped */
+float red_maxp = 0.1;      /* RED: drop probability reached at red_max */
+float codel_target = 5;    /* CoDel: queueing delay it lets a queue keep */
+float codel_interval = 100; /* CoDel: how long above target before dropping */
+
+struct linkpkt {           /* a packet in a bottleneck FIFO */
+	float done;            /* time it leaves the FIFO */
+	int size;
+	struct linkpkt *next;
+};
+struct link {              /* one direction of the bottleneck */
+	struct linkpkt *head, *tail;
+	float free;            /* time the link is done with the last packet */
+	int   bytes;           /* bytes in the FIFO */
+	int   maxbytes;        /* most bytes ever in it */
+	float area, last;      /* integral of bytes over time, up to last */
+	int   nsent;           /* packets it put on the wire */
+	float delay;           /* total time those waited before sending */
+	int   ntaildrop;       /* packets that did not fit */
+	int   naqmdrop;        /* packets RED or CoDel dropped */
+	float red_avg;         /* RED: average queue bytes */
+	int   red_count;       /* RED: packets since its last drop */
+	float codel_above;     /* CoDel: when the delay has been above target */
+	                       /*   for an interval, 0 if it is below */
+	int   codel_dropping;  /* CoDel: 1 in the dropping state */
+	int   codel_count;     /* CoDel: drops in this dropping state */
+	float codel_next;      /* CoDel: time of the next drop */
+} link[2];
+
+/* Store-and-forward path. path_spec lists the hops a packet crosses   */
+/* after the bottleneck and before the medium, blank separated, each   */
+/* as rate:queue:delay:loss. A hop queues up to queue bytes for a link */
+/* of rate bytes per time unit (0: no limit), loses the packet with    */
+/* probability loss and takes delay to reach the next hop.             */
+#define MAX_HOPS 16
+char *path_spec[2] = {NULL, NULL}; /* A->B and B->A, NULL for B->A */
+                           /*   takes the A->B hops in reverse order */
+struct hop {
+	float rate;
+	int   queue;
+	float delay;
+	float loss;
+	int   nlost;           /* packets lost on its wire */
+	struct link link;      /* its FIFO */
+} path[2][MAX_HOPS];
+int npath[2];              /* hops on each path */
+int   ndeferred;           /* number of msgs deferred by sender backpressure */
+int   ndeferq;             /* number of msgs still waiting at layer5 */
+float deferdelay;          /* total time msgs spent deferred at layer5 */
+
+/* FNV-1a, carried on over len more bytes of a stream from hash h */
+unsigned long long fnv_update(h, p, len)
+unsigned long long h;
+char *p;
+int len;
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* host CPU seconds this process has used */
+float cpu_seconds()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+		+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* fill a msg with the next bytes of send_file, as many as its length
+ * asks for, and return 1 if that was the end of the file
+ */
+int read_file_msg(m)
+struct msg *m;
+{
+	int c;
+
+	m->length = fread(m->data, 1, m->length, send_fp);
+	send_hash = fnv_update(send_hash, m->data, m->length);
+	send_bytes += m->length;
+	if ((c = getc(send_fp)) == EOF)
+		return 1;
+	ungetc(c, send_fp);
+	return 0;
+}
 
 main()
 {
 	struct event *eventptr;
 	struct msg  msg2give;
 	struct pkt  pkt2give;
+	struct ackpkt ack2give;
 
 	int i,j;
 	char c;
+	float x, jimsrand(), cpu_seconds();
 
 	init();
 	A_init();
@@ -366,43 +1371,110 @@ main()
 			printf(" entity: %d\n",eventptr->eventity);
 		}
 		time = eventptr->evtime;        /* update time to next event time */
-		if (nsim==nsimmax)
+		nevents++;
+		if (nsim==nsimmax && !run_to_end)
 			break;                        /* all done with simulation */
+		if (eventptr->evtype == FROM_LAYER3 && eventptr->order >= 0)
+			arrived((eventptr->eventity+1) % 2, eventptr->order);
 		if (eventptr->evtype == FROM_LAYER5 ) {
-			generate_next_arrival();   /* set up future arrival */
+			if (workload != 3 && send_fp == NULL)
+				generate_next_arrival();   /* set up future arrival */
+			lastgen = time;
 			/* fill in msg to give with string of same letter */
-			j = nsim % 26;
-			for (i=0; i<20; i++)
-				msg2give.data[i] = 97 + j;
+			msg2give.length = msgsize_min;
+			if (eventptr->msglen >= 0)
+				msg2give.length = eventptr->msglen;
+			else if (msgsize_max > msgsize_min) {
+				msg2give.length += (int) (jimsrand() * (msgsize_max - msgsize_min + 1));
+				if (msg2give.length > msgsize_max)
+					msg2give.length = msgsize_max;
+			}
+			msg2give.buf = pbuf_alloc(msg2give.length);
+			msg2give.data = msg2give.buf->data;
+			if (send_fp != NULL) {
+				/* the next piece of the file, the last msg at its end */
+				if (read_file_msg(&msg2give))
+					nsimmax = nsim + 1;
+				else if (workload != 3)
+					generate_next_arrival();
+			}
+			else {
+				j = nsim % 26;
+				memset(msg2give.data, 97 + j, msg2give.length);
+			}
 			if (TRACE>2) {
 				printf("          MAINLOOP: data given to student: ");
-				for (i=0; i<20; i++)
+				for (i=0; i<msg2give.length; i++)
 					printf("%c", msg2give.data[i]);
 				printf("\n");
 			}
 			nsim++;
+			if (eventptr->eventity == A) {
+				/* A refuses msgs while its buffer is full: hold them */
+				if (deferhead != NULL || !A_output(msg2give))
+					defermsg(msg2give);
+				else {
+					pbuf_unref(msg2give.buf);
+					if (workload == 3 && nsim < nsimmax)
+						generate_next_arrival();
+				}
+			}
+			else {
+				B_output(msg2give);
+				pbuf_unref(msg2give.buf);
+				if (workload == 3 && nsim < nsimmax)
+					generate_next_arrival();
+			}
+		}
+		else if (eventptr->evtype ==  FROM_LAYER3 && eventptr->ackptr != NULL) {
+			ack2give = *eventptr->ackptr;
+			if (eventptr->corrupt) {  /* would the checksum catch it? */
+				nbadarrive[B]++;
+				if (compute_ack_checksum(&ack2give) != ack2give.checksum)
+					nbadcaught[B]++;
+				else
+					nbadmissed++;
+			}
 			if (eventptr->eventity == A)
-				A_output(msg2give);
+				A_ackinput(ack2give);
 			else
-				B_output(msg2give);
+				printf("INTERNAL PANIC: ACK delivered to B \n");
+			free(eventptr->ackptr);
+			draindeferred();
 		}
 		else if (eventptr->evtype ==  FROM_LAYER3) {
-			pkt2give.seqnum = eventptr->pktptr->seqnum;
-			pkt2give.acknum = eventptr->pktptr->acknum;
-			pkt2give.checksum = eventptr->pktptr->checksum;
-			for (i=0; i<20; i++)
-				pkt2give.payload[i] = eventptr->pktptr->payload[i];
+			pkt2give = *eventptr->pktptr;
+			if (eventptr->corrupt) {  /* would the checksum catch it? */
+				nbadarrive[(eventptr->eventity+1) % 2]++;
+				if (compute_checksum(&pkt2give) != pkt2give.checksum)
+					nbadcaught[(eventptr->eventity+1) % 2]++;
+				else {
+					nbadmissed++;
+					if (eventptr->corrupt == 2)  /* follow the bad bytes */
+						bad_mark(pkt2give.buf->data, pkt2give.buf->size);
+				}
+			}
 			if (eventptr->eventity ==A)      /* deliver packet by calling */
 				A_input(pkt2give);            /* appropriate entity */
 			else
 				B_input(pkt2give);
+			pbuf_unref(eventptr->pktptr->buf);
 			free(eventptr->pktptr);          /* free the memory for packet */
+			if (eventptr->eventity == A)
+				draindeferred();
 		}
 		else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-			if (eventptr->eventity == A)
-				A_timerinterrupt();
-			else
+			if (eventptr->eventity == A) {
+				if (eventptr->timerid == 0)
+					A_timerinterrupt();
+				else
+					A_auxtimerinterrupt(eventptr->timerid);
+				draindeferred();
+			}
+			else if (eventptr->timerid == 0)
 				B_timerinterrupt();
+			else
+				B_auxtimerinterrupt(eventptr->timerid);
 		}
 		else  {
 			printf("INTERNAL PANIC: unknown event type \n");
@@ -420,7 +1492,101 @@ main()
 	printf("[%d] packets received at the Transport layer of receiver B\n", number_3);
 	printf("[%d] packets received at the Application layer of receiver B\n", number_4);
 	printf("Total time: [%f] time units\n", time);
-	printf("Throughput = [%f] packets/time units\n\n", number_4 / time);
+	printf("Throughput = [%f] packets/time units\n", number_4 / time);
+	printf("[%d] packets dropped at the full send queue of Sender A\n", number_dropped);
+	printf("Send queue depth: average [%f], maximum [%d]\n",
+			time > 0 ? (queue_area + queue_count * (time - queue_changed)) / time : 0.0,
+			max_queue_depth);
+	printf("Average sender queueing delay = [%f] time units\n",
+			number_queued ? queue_delay / number_queued : 0.0);
+	printf("[%d] msgs coalesced into [%d] packets, average coalescing delay = [%f] time units\n",
+			number_coalesced, number_batches,
+			number_waited ? coalesce_wait / number_waited : 0.0);
+	printf("[%d] window stalls at A, [%d] window probes, [%d] packets B had no room for, at most [%d] bytes unread at B\n",
+			number_window_stalls, number_probes, number_no_room, max_unread);
+	printf("[%d] events simulated\n", nevents);
+	printf("[%d] msgs of [%ld] bytes handed to layer 5, throughput = [%f] bytes/time units\n",
+			nmsgs5, nbytes5, nbytes5 / time);
+	printf("Payload copies: [%d] by A, [%d] in layer 3, [%d] by B\n",
+			ncopies[COPY_A], ncopies[COPY_L3], ncopies[COPY_B]);
+	printf("Payload bytes copied: [%ld] by A, [%ld] in layer 3, [%ld] by B\n",
+			ncopybytes[COPY_A], ncopybytes[COPY_L3], ncopybytes[COPY_B]);
+	printf("[%d] bytes sent into layer 3 by A, [%d] by B (packet headers %d bytes, ACKs %d bytes)\n",
+			nbytes3[A], nbytes3[B], (int) PKT_HEADER, (int) sizeof(struct ackpkt));
+	for (i = 0; i < 2; i++)
+		printf("Medium %s: [%d] packets sent, [%d] lost, [%d] corrupted, [%d] duplicated, "
+				"[%d] corrupted arrivals, [%d] caught\n",
+				i == A ? "A->B" : "B->A", ntolayer3[i], nlost[i], ncorrupt[i],
+				nduplicate[i], nbadarrive[i], nbadcaught[i]);
+	end_burst(A);
+	end_burst(B);
+	printf("Loss bursts A->B: [%d], average [%f], longest [%d] packets\n",
+			nbursts[A], nbursts[A] ? (float) burstlost[A] / nbursts[A] : 0.0,
+			maxburst[A]);
+	printf("Loss bursts B->A: [%d], average [%f], longest [%d] packets\n",
+			nbursts[B], nbursts[B] ? (float) burstlost[B] / nbursts[B] : 0.0,
+			maxburst[B]);
+	if (loss_model == 2) {
+		printf("Trace A->B: [%d] records replayed from %s, [%d] times through\n",
+				replay[A].nrec, replay[A].name, replay[A].nwrap);
+		printf("Trace B->A: [%d] records replayed from %s, [%d] times through\n",
+				replay[B].nrec, replay[B].name, replay[B].nwrap);
+	}
+	if (reorder_prob > 0) {
+		printf("Reordering A->B: [%d] packets held back, [%d] arrived late, displaced by up to [%d]\n",
+				nheld[A], nlate[A], maxdisplace[A]);
+		printf("Reordering B->A: [%d] packets held back, [%d] arrived late, displaced by up to [%d]\n",
+				nheld[B], nlate[B], maxdisplace[B]);
+	}
+	for (i = 0; i < 2; i++)
+		if (link_rate[i] > 0) {
+			link_drain(&link[i], time);
+			printf("Bottleneck %s: average queue [%f] bytes, maximum [%d], "
+					"[%d] tail drops, [%d] AQM drops, average queueing delay [%f]\n",
+					i == A ? "A->B" : "B->A",
+					time > 0 ? (link[i].area + link[i].bytes * (time - link[i].last)) / time : 0.0,
+					link[i].maxbytes, link[i].ntaildrop, link[i].naqmdrop,
+					link[i].nsent ? link[i].delay / link[i].nsent : 0.0);
+		}
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < npath[i]; j++) {
+			/* its FIFO runs ahead of the clock, up to the last arrival */
+			printf("Hop %d %s: [%d] sent, [%d] tail drops, [%d] AQM drops, [%d] lost, "
+					"average queue [%f] bytes, maximum [%d], average queueing delay [%f]\n",
+					j + 1, i == A ? "A->B" : "B->A", path[i][j].link.nsent,
+					path[i][j].link.ntaildrop, path[i][j].link.naqmdrop, path[i][j].nlost,
+					path[i][j].link.last > 0 ? path[i][j].link.area / path[i][j].link.last : 0.0,
+					path[i][j].link.maxbytes,
+					path[i][j].link.nsent ? path[i][j].link.delay / path[i][j].link.nsent : 0.0);
+		}
+	printf("[%d] corrupted packets delivered, [%d] caught by the %s checksum\n",
+			nbadarrive[A] + nbadarrive[B], nbadcaught[A] + nbadcaught[B],
+			checksum_name[checksum_alg]);
+	printf("[%d] slipped past it, [%d] msgs with corrupted data handed to layer 5, "
+			"[%d] packets lost to a corrupted length\n",
+			nbadmissed, nbadmsgs5, nunframed);
+	printf("Workload [%s]: [%d] msgs, average time between them [%f]\n",
+			workload_name[workload], nsim, nsim ? lastgen / nsim : 0.0);
+	if (workload == 4)
+		printf("[%d] arrivals replayed from %s, [%d] times through\n",
+				wl_nrec, workload_file, wl_nwrap);
+	if (send_fp != NULL) {
+		if (recv_fp != NULL)
+			fclose(recv_fp);
+		printf("File transfer: [%ld] bytes read from %s, [%ld] delivered, "
+				"FNV-1a [%016llx] sent and [%016llx] received: %s\n",
+				send_bytes, send_file, recv_bytes, send_hash, recv_hash,
+				send_bytes == recv_bytes && send_hash == recv_hash ? "intact" : "CORRUPTED");
+		x = cpu_seconds() - cpu_start;
+		printf("Goodput [%f] bytes/time unit simulated, host [%f] CPU seconds, "
+				"[%f] bytes/sec, [%f] events/sec\n",
+				time > 0 ? recv_bytes / time : 0.0, x,
+				x > 0 ? recv_bytes / x : 0.0, x > 0 ? nevents / x : 0.0);
+	}
+	printf("[%d] msgs deferred at layer5 by sender backpressure, [%d] never accepted\n",
+			ndeferred, ndeferq);
+	printf("Average layer5 deferral delay = [%f] time units\n\n",
+			ndeferred ? deferdelay / ndeferred : 0.0);
 	/*****************************************************************************************/
 }
 
@@ -430,7 +1596,7 @@ init()                         /* initialize the simulator */
 {
 	int i;
 	float sum, avg;
-	float jimsrand();
+	float jimsrand(), expo();
 
 
 	printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
@@ -440,6 +1606,12 @@ init()                         /* initialize the simulator */
 	scanf("%f",&lossprob);
 	printf("Enter packet corruption probability [0.0 for no corruption]:");
 	scanf("%f",&corruptprob);
+	for (i = 0; i < 2; i++) {
+		if (lossprob_dir[i] < 0)
+			lossprob_dir[i] = lossprob;
+		if (corruptprob_dir[i] < 0)
+			corruptprob_dir[i] = corruptprob;
+	}
 	printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
 	scanf("%f",&lambda);
 	printf("Enter TRACE:");
@@ -457,9 +1629,77 @@ init()                         /* initialize the simulator */
 		exit(0);
 	}
 
-	ntolayer3 = 0;
-	nlost = 0;
-	ncorrupt = 0;
+	for (i = 0; i < 2; i++)
+		ntolayer3[i] = nlost[i] = ncorrupt[i] = nduplicate[i]
+			= nbadarrive[i] = nbadcaught[i] = 0;
+	nbadmissed = nbadmsgs5 = nunframed = 0;
+	nbytes3[A] = nbytes3[B] = 0;
+	for (i = 0; i < 2; i++) {
+		memset(&link[i], 0, sizeof link[i]);
+		ge_bad[i] = 0;
+		lossrun[i] = nbursts[i] = burstlost[i] = maxburst[i] = 0;
+		lastarrival[i] = 0.0;
+		nsent3[i] = nheld[i] = nlate[i] = maxdisplace[i] = 0;
+		maxorder[i] = -1;
+	}
+	if (loss_model == 2) {
+		if (trace_file[A] == NULL) {
+			printf("Trace replay needs a trace_file.\n");
+			exit(0);
+		}
+		replay_open(&replay[A], trace_file[A]);
+		replay_open(&replay[B], trace_file[B] != NULL ? trace_file[B] : trace_file[A]);
+	}
+	npath[A] = npath[B] = 0;
+	if (path_spec[A] != NULL) {
+		path_parse(A, path_spec[A]);
+		if (path_spec[B] != NULL)
+			path_parse(B, path_spec[B]);
+		else {
+			npath[B] = npath[A];
+			for (i = 0; i < npath[A]; i++)
+				path[B][i] = path[A][npath[A] - 1 - i];
+		}
+	}
+	nmsgs5 = 0;
+	nevents = 0;
+	nbytes5 = 0;
+	for (i = 0; i < 3; i++) {
+		ncopies[i] = 0;
+		ncopybytes[i] = 0;
+	}
+	ndeferred = 0;
+	ndeferq = 0;
+	deferdelay = 0.0;
+
+	lastgen = 0.0;
+	cpu_start = cpu_seconds();
+	run_to_end = (workload == 3 || send_file != NULL);
+	send_fp = recv_fp = NULL;
+	if (send_file != NULL) {
+		if ((send_fp = fopen(send_file, "rb")) == NULL) {
+			printf("Cannot open file %s to send.\n", send_file);
+			exit(0);
+		}
+		if (recv_file != NULL && (recv_fp = fopen(recv_file, "wb")) == NULL) {
+			printf("Cannot open file %s to receive into.\n", recv_file);
+			exit(0);
+		}
+		nsimmax = INT_MAX;         /* the file decides how many msgs */
+		send_bytes = recv_bytes = 0;
+		send_hash = recv_hash = 14695981039346656037ULL;
+	}
+	if (workload == 2)
+		on_end = on_time * expo();
+	if (workload == 4) {
+		if (workload_file == NULL || (wl_fp = fopen(workload_file, "r")) == NULL) {
+			printf("Cannot open workload file %s.\n",
+					workload_file != NULL ? workload_file : "(none)");
+			exit(0);
+		}
+		wl_offset = wl_last = 0.0;
+		wl_nrec = wl_nwrap = 0;
+	}
 
 	time=0.0;                    /* initialize time to 0.0 */
 	generate_next_arrival();     /* initialize event list */
@@ -482,6 +1722,64 @@ float jimsrand()
 /*  The next set of routines handle the event list   */
 /*****************************************************/
 
+/* an exponential variate of mean 1, by von Neumann's method: a draw u
+ * is kept when the run of ever smaller draws after it has even length,
+ * which happens with probability e^-u, and each one thrown away adds 1.
+ * It needs no log(), so no libm.
+ */
+float expo()
+{
+	float u, v, w, k;
+	int n;
+
+	for (k = 0; ; k++) {
+		u = v = jimsrand();
+		for (n = 0; (w = jimsrand()) < v; n++)
+			v = w;
+		if (n % 2 == 0)
+			return k + u;
+	}
+}
+
+/* the time of the next arrival in workload_file, starting over after
+ * the last one.  A line holds the time of an arrival, optionally
+ * followed by the length of its msg, which is stored in *msglen.  Blank
+ * lines and lines starting with # are skipped.  The file is read as the
+ * simulation goes, so it can be of any length.
+ */
+float next_replayed(msglen)
+int *msglen;
+{
+	char line[256];
+	float t;
+	int n, len;
+
+	for (;;) {
+		if (fgets(line, sizeof line, wl_fp) == NULL) {
+			if (wl_nrec == 0) {
+				printf("Workload file %s has no arrivals.\n", workload_file);
+				exit(0);
+			}
+			rewind(wl_fp);
+			wl_offset = wl_last;
+			wl_nwrap++;
+			continue;
+		}
+		n = strspn(line, " \t\r\n");
+		if (line[n] == '#' || line[n] == '\0')
+			continue;
+		if ((n = sscanf(line, "%f %d", &t, &len)) < 1) {
+			printf("Bad line in workload file %s: %s", workload_file, line);
+			exit(0);
+		}
+		break;
+	}
+	wl_nrec++;
+	*msglen = (n == 2 && len >= 0) ? len : -1;
+	wl_last = wl_offset + t;
+	return wl_last;
+}
+
 generate_next_arrival()
 {
 	double x,log(),ceil();
@@ -492,9 +1790,28 @@ generate_next_arrival()
 	if (TRACE>2)
 		printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
 
-	x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
-	/* having mean of lambda        */
 	evptr = (struct event *)malloc(sizeof(struct event));
+	evptr->msglen = -1;
+	if (workload == 1)
+		x = lambda * expo();
+	else if (workload == 2) {
+		ttime = time + lambda * expo();
+		while (ttime > on_end) {  /* silent until the next on period */
+			ttime = on_end + off_time * expo();
+			on_end = ttime + on_time * expo();
+			ttime += lambda * expo();
+		}
+		x = ttime - time;
+	}
+	else if (workload == 3)
+		x = 0;                    /* A took the last one: here is another */
+	else if (workload == 4) {
+		ttime = next_replayed(&evptr->msglen);
+		x = ttime > time ? ttime - time : 0;
+	}
+	else
+		x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
+	/* having mean of lambda        */
 	evptr->evtime =  time + x;
 	evptr->evtype =  FROM_LAYER5;
 	if (BIDIRECTIONAL && (jimsrand()>0.5) )
@@ -543,6 +1860,46 @@ struct event *p;
 	}
 }
 
+/* hold a msg that A refused at layer5 until A has room for it */
+defermsg(message)
+struct msg message;
+{
+	struct deferred *d;
+
+	d = (struct deferred *)malloc(sizeof(struct deferred));
+	d->msg = message;
+	d->arrtime = time;
+	d->next = NULL;
+	if (defertail == NULL)
+		deferhead = d;
+	else
+		defertail->next = d;
+	defertail = d;
+	ndeferred++;
+	ndeferq++;
+	if (TRACE>2)
+		printf("          DEFERMSG: sender full, %d msgs deferred\n", ndeferq);
+}
+
+/* offer deferred msgs to A again, oldest first, until it refuses one */
+draindeferred()
+{
+	struct deferred *d;
+
+	while (deferhead != NULL && A_output(deferhead->msg)) {
+		d = deferhead;
+		pbuf_unref(d->msg.buf);
+		deferdelay += time - d->arrtime;
+		deferhead = d->next;
+		if (deferhead == NULL)
+			defertail = NULL;
+		ndeferq--;
+		free(d);
+		if (workload == 3 && nsim < nsimmax)  /* the bulk source has the next one */
+			generate_next_arrival();
+	}
+}
+
 printevlist()
 {
 	struct event *q;
@@ -558,9 +1915,23 @@ printevlist()
 
 /********************** Student-callable ROUTINES ***********************/
 
+/* returns the current simulated time */
+float get_sim_time()
+{
+	return(time);
+}
+
 /* called by students routine to cancel a previously-started timer */
 stoptimer(AorB)
 int AorB;  /* A or B is trying to stop timer */
+{
+	stopauxtimer(AorB, 0);
+}
+
+/* stop one of the extra timers of an entity, numbered from 1 up */
+stopauxtimer(AorB,timerid)
+int AorB;  /* A or B is trying to stop timer */
+int timerid;
 {
 	struct event *q,*qold;
 
@@ -568,7 +1939,8 @@ int AorB;  /* A or B is trying to stop timer */
 		printf("          STOP TIMER: stopping timer at %f\n",time);
 	/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
 	for (q=evlist; q!=NULL ; q = q->next)
-		if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) {
+		if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB
+					&& q->timerid==timerid) ) {
 			/* remove this event */
 			if (q->next==NULL && q->prev==NULL)
 				evlist=NULL;         /* remove first and only event on list */
@@ -592,6 +1964,16 @@ int AorB;  /* A or B is trying to stop timer */
 starttimer(AorB,increment)
 int AorB;  /* A or B is trying to stop timer */
 float increment;
+{
+	startauxtimer(AorB, 0, increment);
+}
+
+/* start one of the extra timers of an entity, numbered from 1 up. */
+/* It goes off in A_auxtimerinterrupt() or B_auxtimerinterrupt().  */
+startauxtimer(AorB,timerid,increment)
+int AorB;  /* A or B is trying to stop timer */
+int timerid;
+float increment;
 {
 
 	struct event *q;
@@ -603,7 +1985,8 @@ float increment;
 	/* be nice: check to see if timer is already started, if so, then  warn */
 	/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
 	for (q=evlist; q!=NULL ; q = q->next)
-		if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) {
+		if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB
+					&& q->timerid==timerid) ) {
 			printf("Warning: attempt to start a timer that is already started\n");
 			return;
 		}
@@ -613,27 +1996,544 @@ float increment;
 	evptr->evtime =  time + increment;
 	evptr->evtype =  TIMER_INTERRUPT;
 	evptr->eventity = AorB;
+	evptr->timerid = timerid;
 	insertevent(evptr);
 }
 
 
+/* Decide whether the packet AorB is sending is lost. Under the
+ * Gilbert-Elliott model the direction's two-state Markov chain takes
+ * one step per packet, then the packet is lost with the loss
+ * probability of the state it is in.
+ */
+int channel_loses(AorB)
+int AorB;
+{
+	float jimsrand();
+	int lost;
+
+	if (loss_model == 2) {
+		replay_next(&replay[AorB]);
+		lost = replay[AorB].lost;
+	}
+	else if (loss_model == 1) {
+		if (ge_bad[AorB]) {
+			if (jimsrand() < ge_r[AorB])
+				ge_bad[AorB] = 0;
+		}
+		else if (jimsrand() < ge_p[AorB])
+			ge_bad[AorB] = 1;
+		lost = jimsrand() < (ge_bad[AorB] ? ge_loss_bad[AorB] : ge_loss_good[AorB]);
+	}
+	else
+		lost = jimsrand() < lossprob_dir[AorB];
+
+	if (lost)
+		lossrun[AorB]++;
+	else
+		end_burst(AorB);
+	return lost;
+}
+
+/* A packet got through, or the run is over: close the current
+ * loss burst of a direction, if any
+ */
+end_burst(AorB)
+int AorB;
+{
+	if (lossrun[AorB] == 0)
+		return;
+	nbursts[AorB]++;
+	burstlost[AorB] += lossrun[AorB];
+	if (lossrun[AorB] > maxburst[AorB])
+		maxburst[AorB] = lossrun[AorB];
+	lossrun[AorB] = 0;
+}
+
+/* Take the packets that have left a bottleneck FIFO by time now off
+ * it, accounting the queue size over time as they go
+ */
+link_drain(l, now)
+struct link *l;
+float now;
+{
+	struct linkpkt *lp;
+
+	while (l->head != NULL && l->head->done <= now) {
+		lp = l->head;
+		l->area += l->bytes * (lp->done - l->last);
+		l->last = lp->done;
+		l->bytes -= lp->size;
+		l->head = lp->next;
+		free(lp);
+	}
+	if (l->head == NULL)
+		l->tail = NULL;
+	l->area += l->bytes * (now - l->last);
+	l->last = now;
+}
+
+/* RED: returns 1 if an arriving packet is to be dropped early */
+int red_drops(l)
+struct link *l;
+{
+	float pb, pa, jimsrand();
+
+	l->red_avg += red_wq * (l->bytes - l->red_avg);
+	if (l->red_avg < red_min) {
+		l->red_count = 0;
+		return 0;
+	}
+	if (l->red_avg >= red_max) {
+		l->red_count = 0;
+		return 1;
+	}
+	/* spread the drops out evenly between two drops */
+	pb = red_maxp * (l->red_avg - red_min) / (red_max - red_min);
+	pa = l->red_count * pb < 1 ? pb / (1 - l->red_count * pb) : 1;
+	l->red_count++;
+	if (jimsrand() < pa) {
+		l->red_count = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* codel_interval / sqrt(count), the CoDel spacing between drops */
+float codel_spacing(count)
+int count;
+{
+	float x;
+	int i;
+
+	x = count;
+	for (i = 0; i < 16; i++)      /* Newton's method for the root */
+		x = (x + count / x) / 2;
+	return codel_interval / x;
+}
+
+/* CoDel: returns 1 if a packet that leaves the FIFO at time now,
+ * having waited sojourn in it, is to be dropped instead of sent
+ */
+int codel_drops(l, now, sojourn)
+struct link *l;
+float now, sojourn;
+{
+	int ok_to_drop;
+
+	ok_to_drop = 0;
+	if (sojourn < codel_target)
+		l->codel_above = 0;
+	else if (l->codel_above == 0)
+		l->codel_above = now + codel_interval;
+	else if (now >= l->codel_above)
+		ok_to_drop = 1;
+
+	if (l->codel_dropping) {
+		if (!ok_to_drop) {
+			l->codel_dropping = 0;
+			return 0;
+		}
+		if (now < l->codel_next)
+			return 0;
+		l->codel_count++;
+		l->codel_next += codel_spacing(l->codel_count);
+		return 1;
+	}
+	if (!ok_to_drop)
+		return 0;
+	/* start dropping, at the rate it last left off if that was recent */
+	l->codel_dropping = 1;
+	if (l->codel_count > 2 && now - l->codel_next < 8 * codel_interval)
+		l->codel_count -= 2;
+	else
+		l->codel_count = 1;
+	l->codel_next = now + codel_spacing(l->codel_count);
+	return 1;
+}
+
+/* Put a packet of size bytes that AorB sends through the bottleneck.
+ * Returns the time it is off the link, or -1 if it is dropped.
+ */
+float link_send(l, now, size, rate, qbytes)
+struct link *l;
+float now, rate;
+int size, qbytes;
+{
+	struct linkpkt *lp;
+	float start;
+	int drop;
+
+	link_drain(l, now);
+	if (l->bytes + size > qbytes) {
+		l->ntaildrop++;
+		if (TRACE>0)
+			printf("          TOLAYER3: packet tail-dropped at the bottleneck\n");
+		return -1;
+	}
+	if (aqm == 1 && red_drops(l)) {
+		l->naqmdrop++;
+		if (TRACE>0)
+			printf("          TOLAYER3: packet dropped by RED\n");
+		return -1;
+	}
+
+	/* The FIFO is served in order, so when the packet gets to the
+	 * link is known now. CoDel judges it by then.
+	 */
+	start = l->free > now ? l->free : now;
+	drop = (aqm == 2 && codel_drops(l, start, start - now));
+
+	lp = (struct linkpkt *)malloc(sizeof(struct linkpkt));
+	lp->done = drop ? start : start + size / rate;
+	lp->size = size;
+	lp->next = NULL;
+	if (l->tail == NULL)
+		l->head = lp;
+	else
+		l->tail->next = lp;
+	l->tail = lp;
+	l->bytes += size;
+	if (l->bytes > l->maxbytes)
+		l->maxbytes = l->bytes;
+
+	if (drop) {
+		l->naqmdrop++;
+		if (TRACE>0)
+			printf("          TOLAYER3: packet dropped by CoDel\n");
+		return -1;
+	}
+	l->free = lp->done;
+	l->nsent++;
+	l->delay += start - now;
+	return lp->done;
+}
+
+/* read a path_spec into the hops of one direction */
+path_parse(AorB, spec)
+int AorB;
+char *spec;
+{
+	struct hop *h;
+	int n;
+
+	npath[AorB] = 0;
+	while (sscanf(spec, " %n", &n) == 0 && spec[n] != '\0') {
+		spec += n;
+		if (npath[AorB] == MAX_HOPS) {
+			printf("Path has more than %d hops.\n", MAX_HOPS);
+			exit(0);
+		}
+		h = &path[AorB][npath[AorB]++];
+		memset(h, 0, sizeof *h);
+		if (sscanf(spec, "%f:%d:%f:%f%n", &h->rate, &h->queue, &h->delay, &h->loss, &n) != 4
+				|| h->rate < 0 || h->delay < 0) {
+			printf("Bad hop %d in path \"%s\".\n", npath[AorB], spec);
+			exit(0);
+		}
+		spec += n;
+	}
+}
+
+/* carry a packet that sets off at time now along the hops of its
+ * direction.  The hops are FIFOs with a fixed delay between them, so
+ * packets reach each hop in the order they left the one before, and
+ * when a packet gets through every queue is known the moment it is
+ * sent: returns the time it comes off the last hop, or -1 if one of
+ * them drops or loses it
+ */
+float path_send(AorB, now, size)
+int AorB, size;
+float now;
+{
+	struct hop *h;
+	int i;
+	float jimsrand();
+
+	for (i = 0; i < npath[AorB]; i++) {
+		h = &path[AorB][i];
+		if (h->rate <= 0)
+			h->link.nsent++;
+		else if ((now = link_send(&h->link, now, size, h->rate, h->queue)) < 0)
+			return -1;
+		if (h->loss > 0 && jimsrand() < h->loss) {
+			h->nlost++;
+			if (TRACE>0)
+				printf("          TOLAYER3: packet lost at hop %d\n", i + 1);
+			return -1;
+		}
+		now += h->delay;
+	}
+	return now;
+}
+
+/* map a trace file for replay_next(); it is read front to back, so the
+ * kernel is told to read ahead and the pages are let go of once used
+ */
+replay_open(r, name)
+struct replay *r;
+char *name;
+{
+	struct stat st;
+	FILE *fp;
+
+	memset(r, 0, sizeof *r);
+	r->name = name;
+	if ((fp = fopen(name, "r")) == NULL || fstat(fileno(fp), &st) < 0) {
+		printf("Cannot open trace %s.\n", name);
+		exit(0);
+	}
+	r->size = st.st_size;
+	if (r->size == 0) {
+		printf("Trace %s has no records.\n", name);
+		exit(0);
+	}
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	fclose(fp);
+	if (r->map == MAP_FAILED) {
+		printf("Cannot map trace %s.\n", name);
+		exit(0);
+	}
+	madvise(r->map, r->size, MADV_SEQUENTIAL);
+}
+
+/* read the next record of a trace, starting over at its end.  A record
+ * is a line with the packet's one-way delay in time units, followed by
+ * L if it was lost or C if it was corrupted.  Blank lines and lines
+ * starting with # are skipped.
+ */
+replay_next(r)
+struct replay *r;
+{
+	char *p, *end;
+	float scale;
+	int digits;
+
+	end = r->map + r->size;
+	for (;;) {
+		if (r->pos >= r->size) {
+			if (r->nrec == 0) {
+				printf("Trace %s has no records.\n", r->name);
+				exit(0);
+			}
+			r->pos = r->released = 0;
+			r->nwrap++;
+		}
+		p = r->map + r->pos;
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			p++;
+		if (p < end && *p != '#' && *p != '\n')
+			break;
+		while (p < end && *p != '\n')
+			p++;
+		r->pos = p + 1 - r->map;
+	}
+
+	r->delay = 0.0;
+	digits = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		r->delay = r->delay * 10 + (*p - '0');
+	if (p < end && *p == '.')
+		for (p++, scale = 0.1; p < end && *p >= '0' && *p <= '9'; p++, digits++, scale /= 10)
+			r->delay += (*p - '0') * scale;
+	if (digits == 0) {
+		printf("Trace %s: no delay at byte %ld.\n", r->name, (long) (p - r->map));
+		exit(0);
+	}
+	r->lost = r->corrupt = 0;
+	for (; p < end && *p != '\n'; p++)
+		if (*p == 'L' || *p == 'l')
+			r->lost = 1;
+		else if (*p == 'C' || *p == 'c')
+			r->corrupt = 1;
+	r->pos = p + 1 - r->map;
+	r->nrec++;
+
+	/* the page cache keeps what was read; drop it so a trace of any
+	   size only ever holds a chunk or so in memory */
+	if (r->pos - r->released >= 2 * REPLAY_CHUNK) {
+		madvise(r->map + r->released, REPLAY_CHUNK, MADV_DONTNEED);
+		r->released += REPLAY_CHUNK;
+	}
+}
+
+/* note a packet sent by AorB arriving, and whether later ones beat it */
+arrived(AorB, order)
+int AorB, order;
+{
+	if (order > maxorder[AorB]) {
+		maxorder[AorB] = order;
+		return;
+	}
+	nlate[AorB]++;
+	if (maxorder[AorB] - order > maxdisplace[AorB])
+		maxdisplace[AorB] = maxorder[AorB] - order;
+}
+
+/* extra delay for a packet the medium lets later ones overtake, 0 if it
+ * stays in order
+ */
+float reorder_hold()
+{
+	float extra;
+
+	if (reorder_prob <= 0 || jimsrand() >= reorder_prob)
+		return 0.0;
+	if (reorder_dist == 0)
+		return 2 * reorder_delay * jimsrand();
+	extra = 10;
+	while (reorder_delay > 10 && jimsrand() < 1 - 10 / reorder_delay)
+		extra += 10;
+	return extra;
+}
+
+/* chance that none of n bits on the wire flips, (1 - rate) to the n */
+double ber_clean(rate, n)
+double rate;
+int n;
+{
+	double q, r;
+
+	q = 1 - rate;
+	r = 1.0;
+	for (; n > 0; n >>= 1) {
+		if (n & 1)
+			r *= q;
+		q *= q;
+	}
+	return r;
+}
+
+/* the next bit in [from, nbits) that flips at the bit error rate, or
+ * nbits if none does.  One draw decides: the first flip is at k with
+ * u < 1 - (1 - rate)^(k+1), searched for by halving, so it costs no
+ * more for a low rate
+ */
+int ber_next(rate, from, nbits)
+double rate;
+int from, nbits;
+{
+	double u;
+	int lo, hi, mid;
+
+	if (from >= nbits || rate <= 0)
+		return nbits;
+	u = jimsrand();
+	if (u >= 1 - ber_clean(rate, nbits - from))
+		return nbits;
+	lo = 0;
+	hi = nbits - from - 1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (u < 1 - ber_clean(rate, mid + 1))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return from + lo;
+}
+
+/* flip the bits of a packet or ACK as serialized on the wire.  A damaged
+ * packet gets a payload buffer of its own, MAX_MSS long so that whatever
+ * length it now claims stays inside it; returns -1 if that length is out
+ * of range, so the frame cannot be delimited at all
+ */
+int bit_errors(AorB, evptr, size)
+int AorB;
+struct event *evptr;
+int size;
+{
+	char wire[PKT_HEADER + MAX_MSS];
+	int hdr[5], bit;
+	struct pkt *p;
+	struct pbuf *b;
+
+	bit = ber_next(ber[AorB], 0, 8 * size);
+	if (bit == 8 * size)
+		return 0;
+	p = evptr->pktptr;
+	if (p != NULL) {
+		hdr[0] = p->seqnum;
+		hdr[1] = p->acknum;
+		hdr[2] = p->checksum;
+		hdr[3] = p->length;
+		hdr[4] = p->eom;
+		memcpy(wire, hdr, PKT_HEADER);
+		memcpy(wire + PKT_HEADER, p->payload, p->length);
+	}
+	else
+		memcpy(wire, evptr->ackptr, sizeof(struct ackpkt));
+	for (; bit < 8 * size; bit = ber_next(ber[AorB], bit + 1, 8 * size))
+		wire[bit / 8] ^= 1 << (bit % 8);
+
+	ncorrupt[AorB]++;
+	evptr->corrupt = 1;
+	if (p == NULL) {
+		memcpy(evptr->ackptr, wire, sizeof(struct ackpkt));
+		return 0;
+	}
+	memcpy(hdr, wire, PKT_HEADER);
+	b = pbuf_alloc(MAX_MSS);
+	memset(b->data, 0, MAX_MSS);
+	pbuf_copy(b->data, wire + PKT_HEADER, p->length, COPY_L3);
+	pbuf_unref(p->buf);
+	p->buf = b;
+	p->payload = b->data;
+	p->seqnum = hdr[0];
+	p->acknum = hdr[1];
+	p->checksum = hdr[2];
+	p->length = hdr[3];
+	p->eom = hdr[4];
+	evptr->corrupt = 2;
+	return (p->length < 0 || p->length > MAX_MSS) ? -1 : 0;
+}
+
 /************************** TOLAYER3 ***************/
 tolayer3(AorB,packet)
 int AorB;  /* A or B is trying to stop timer */
 struct pkt packet;
+{
+	tolayer3_channel(AorB, &packet, NULL);
+}
+
+/* send a compact, header-only ACK into layer 3 */
+tolayer3_ack(AorB,ack)
+int AorB;
+struct ackpkt ack;
+{
+	tolayer3_channel(AorB, NULL, &ack);
+}
+
+/* carry either a packet or a compact ACK across the medium */
+tolayer3_channel(AorB,packet,ack)
+int AorB;
+struct pkt *packet;
+struct ackpkt *ack;
 {
 	struct pkt *mypktptr;
-	struct event *evptr,*q;
+	struct ackpkt *myackptr;
+	struct pbuf *b;
+	struct event *evptr,*dupptr;
 	// char *malloc();
-	float lastime, x, jimsrand();
-	int i;
+	float lastime, linktime, hold, x, jimsrand();
+	int i, size;
+
 
+	ntolayer3[AorB]++;
+	size = packet != NULL ? PKT_HEADER + packet->length : sizeof(struct ackpkt);
+	nbytes3[AorB] += size;
 
-	ntolayer3++;
+	/* simulate the bottleneck: */
+	linktime = time;
+	if (link_rate[AorB] > 0 && (linktime = link_send(&link[AorB], time, size,
+			link_rate[AorB], link_queue_bytes)) < 0)
+		return;
+	if (npath[AorB] > 0 && (linktime = path_send(AorB, linktime, size)) < 0)
+		return;
 
 	/* simulate losses: */
-	if (jimsrand() < lossprob)  {
-		nlost++;
+	if (channel_loses(AorB))  {
+		nlost[AorB]++;
 		if (TRACE>0)
 			printf("          TOLAYER3: packet being lost\n");
 		return;
@@ -641,18 +2541,27 @@ struct pkt packet;
 
 	/* make a copy of the packet student just gave me since he/she may decide */
 	/* to do something with the packet after we return back to him/her */
-	mypktptr = (struct pkt *)malloc(sizeof(struct pkt));
-	mypktptr->seqnum = packet.seqnum;
-	mypktptr->acknum = packet.acknum;
-	mypktptr->checksum = packet.checksum;
-	for (i=0; i<20; i++)
-		mypktptr->payload[i] = packet.payload[i];
-	if (TRACE>2)  {
-		printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
-				mypktptr->acknum,  mypktptr->checksum);
-		for (i=0; i<20; i++)
-			printf("%c",mypktptr->payload[i]);
-		printf("\n");
+	mypktptr = NULL;
+	myackptr = NULL;
+	if (packet != NULL) {
+		/* the copy shares the payload, it only takes a reference */
+		mypktptr = (struct pkt *)malloc(sizeof(struct pkt));
+		*mypktptr = *packet;
+		pbuf_ref(mypktptr->buf);
+		if (TRACE>2)  {
+			printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
+					mypktptr->acknum,  mypktptr->checksum);
+			for (i=0; i<mypktptr->length; i++)
+				printf("%c",mypktptr->payload[i]);
+			printf("\n");
+		}
+	}
+	else {
+		myackptr = (struct ackpkt *)malloc(sizeof(struct ackpkt));
+		*myackptr = *ack;
+		if (TRACE>2)
+			printf("          TOLAYER3: ACK seq: %d, ack %d, check: %d\n",
+					myackptr->seqnum, myackptr->acknum, myackptr->checksum);
 	}
 
 	/* create future event for arrival of packet at the other side */
@@ -660,28 +2569,79 @@ struct pkt packet;
 	evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
 	evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
 	evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
+	evptr->ackptr = myackptr;
+	evptr->corrupt = 0;
+	evptr->order = nsent3[AorB]++;
 	/* finally, compute the arrival time of packet at the other end.
-   medium can not reorder, so make sure packet arrives between 1 and 10
-   time units after the latest arrival time of packets
-   currently in the medium on their way to the destination */
-	lastime = time;
-	/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
-	for (q=evlist; q!=NULL ; q = q->next)
-		if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) )
-			lastime = q->evtime;
-	evptr->evtime =  lastime + 1 + 9*jimsrand();
+   medium does not reorder on its own, so make sure packet arrives
+   between 1 and 10 time units after the latest in-order arrival time
+   of packets on their way to the destination.  Arrivals already past
+   are no later than now, so the latest one scheduled is enough. */
+	lastime = linktime;
+	if (lastarrival[AorB] > lastime)
+		lastime = lastarrival[AorB];
+	if (loss_model == 2)        /* the trace has its own delays, in order or not */
+		evptr->evtime = linktime + replay[AorB].delay;
+	else
+		evptr->evtime =  lastime + delay_min[AorB] + delay_spread[AorB]*jimsrand();
+	/* a held back packet does not hold back the ones behind it */
+	hold = reorder_hold();
+	if (hold > 0) {
+		nheld[AorB]++;
+		evptr->evtime += hold;
+		if (TRACE>0)
+			printf("          TOLAYER3: packet held back %f\n", hold);
+	}
+	else
+		lastarrival[AorB] = evptr->evtime;
 
 
 
 	/* simulate corruption: */
-	if (jimsrand() < corruptprob)  {
-		ncorrupt++;
-		if ( (x = jimsrand()) < .75)
-			mypktptr->payload[0]='Z';   /* corrupt payload */
-		else if (x < .875)
-			mypktptr->seqnum = 999999;
-		else
-			mypktptr->acknum = 999999;
+	if (corrupt_model == 1) {
+		if (bit_errors(AorB, evptr, size) < 0) {
+			nunframed++;
+			if (TRACE>0)
+				printf("          TOLAYER3: packet lost to a corrupted length\n");
+			pbuf_unref(mypktptr->buf);
+			free(mypktptr);
+			free(evptr);
+			return;
+		}
+		if (evptr->corrupt && TRACE>0)
+			printf("          TOLAYER3: packet being corrupted\n");
+	}
+	else if (loss_model == 2 ? replay[AorB].corrupt : jimsrand() < corruptprob_dir[AorB])  {
+		ncorrupt[AorB]++;
+		evptr->corrupt = 1;
+		if ( (x = jimsrand()) < .75) {
+			if (mypktptr != NULL && mypktptr->length > 0) {
+				/* the payload is shared: corrupt a private copy */
+				b = pbuf_alloc(mypktptr->length);
+				pbuf_copy(b->data, mypktptr->payload, mypktptr->length, COPY_L3);
+				pbuf_unref(mypktptr->buf);
+				mypktptr->buf = b;
+				mypktptr->payload = b->data;
+				mypktptr->payload[0] ^= 0x20;  /* corrupt payload, for sure */
+				evptr->corrupt = 2;
+			}
+			else if (mypktptr != NULL)
+				mypktptr->seqnum = 999999;   /* no payload to corrupt */
+			else
+				myackptr->checksum = 999999; /* ACKs have no payload */
+		}
+		else if (x < .875) {
+			if (mypktptr != NULL)
+				mypktptr->seqnum = 999999;
+			else
+				myackptr->seqnum = 999999;
+		}
+		else {
+			if (mypktptr != NULL)
+				mypktptr->acknum = 999999;
+			else
+				myackptr->acknum = 999999;
+		}
 		if (TRACE>0)
 			printf("          TOLAYER3: packet being corrupted\n");
 	}
@@ -689,16 +2649,52 @@ struct pkt packet;
 	if (TRACE>2)
 		printf("          TOLAYER3: scheduling arrival on other side\n");
 	insertevent(evptr);
+
+	/* simulate duplication: an uncorrupted copy arrives after the first */
+	if (dupprob[AorB] > 0 && jimsrand() < dupprob[AorB])  {
+		nduplicate[AorB]++;
+		dupptr = (struct event *)malloc(sizeof(struct event));
+		*dupptr = *evptr;
+		dupptr->corrupt = 0;
+		dupptr->order = -1;        /* not a packet of its own for reordering */
+		if (packet != NULL) {
+			dupptr->pktptr = (struct pkt *)malloc(sizeof(struct pkt));
+			*dupptr->pktptr = *packet;
+			pbuf_ref(packet->buf);
+		}
+		else {
+			dupptr->ackptr = (struct ackpkt *)malloc(sizeof(struct ackpkt));
+			*dupptr->ackptr = *ack;
+		}
+		/* behind the original but ahead of the next in-order arrival,
+		   which is at least delay_min later: still FIFO, and later
+		   traffic is not held back */
+		dupptr->evtime = evptr->evtime + delay_min[AorB]*jimsrand();
+		if (TRACE>0)
+			printf("          TOLAYER3: packet being duplicated\n");
+		insertevent(dupptr);
+	}
 }
 
-tolayer5(AorB,datasent)
+tolayer5(AorB,datasent,length)
 int AorB;
-char datasent[20];
+char *datasent;
+int length;
 {
 	int i;
+	nmsgs5++;
+	nbytes5 += length;
+	if (nbadranges > 0 && bad_overlaps(datasent, length))
+		nbadmsgs5++;
+	if (AorB == B && send_fp != NULL) {
+		recv_hash = fnv_update(recv_hash, datasent, length);
+		recv_bytes += length;
+		if (recv_fp != NULL)
+			fwrite(datasent, 1, length, recv_fp);
+	}
 	if (TRACE>2) {
 		printf("          TOLAYER5: data received: ");
-		for (i=0; i<20; i++)
+		for (i=0; i<length; i++)
 			printf("%c",datasent[i]);
 		printf("\n");
 	}